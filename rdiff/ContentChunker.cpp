@@ -0,0 +1,77 @@
+/*
+ * This file is part of rdiff (https://github.com/thradde/rdiff).
+ * Copyright (c) 2025 Thorsten Radde.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ContentChunker.h"
+
+
+CContentChunker::CContentChunker()
+{
+	// Old and new files must be chunked with the same gear table,
+	// so it is generated from a fixed seed (splitmix64).
+	uint64_t seed = 0x2545f4914f6cdd1d;
+	for (int i = 0; i < 256; i++)
+	{
+		uint64_t z = (seed += 0x9e3779b97f4a7c15);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		m_nGearTable[i] = z ^ (z >> 31);
+	}
+
+	// log2(ChunkSizeAvg) bits, +/- 2 bits for normalized chunking.
+	// The gear hash shifts left, so the upper bits depend on the most bytes.
+	int bits = 0;
+	while (((size_t)1 << bits) < ChunkSizeAvg)
+		bits++;
+
+	m_nMaskSmall = ~(uint64_t)0 << (64 - (bits + 2));
+	m_nMaskLarge = ~(uint64_t)0 << (64 - (bits - 2));
+}
+
+
+size_t CContentChunker::NextChunk(const char *buffer, size_t len) const
+{
+	if (len <= ChunkSizeMin)
+		return len;
+
+	size_t normal_size = ChunkSizeAvg;
+	if (len > ChunkSizeMax)
+		len = ChunkSizeMax;
+	else if (len < normal_size)
+		normal_size = len;
+
+	const unsigned char *p = (const unsigned char *)buffer;
+	uint64_t hash = 0;
+	size_t i = ChunkSizeMin;
+	for (; i < normal_size; i++)
+	{
+		hash = (hash << 1) + m_nGearTable[p[i]];
+		if (!(hash & m_nMaskSmall))
+			return i + 1;
+	}
+
+	for (; i < len; i++)
+	{
+		hash = (hash << 1) + m_nGearTable[p[i]];
+		if (!(hash & m_nMaskLarge))
+			return i + 1;
+	}
+
+	return len;
+}
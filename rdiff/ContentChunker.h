@@ -0,0 +1,45 @@
+/*
+ * This file is part of rdiff (https://github.com/thradde/rdiff).
+ * Copyright (c) 2025 Thorsten Radde.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Content-defined chunking (FastCDC)
+//
+// Chunk boundaries are found by a rolling gear hash over the content, not by fixed offsets.
+// So identical content yields identical chunks, no matter where it is located in a file,
+// or in which file it is located. Normalized chunking keeps chunk sizes close to ChunkSizeAvg.
+//
+// Chunks are small compared to typical deduplication tools, because identical regions
+// of executables are often only some hundred bytes long.
+//
+// The gear hash only depends on the last 64 bytes, so boundary candidates could be computed
+// in independent vector lanes (SS-CDC, VectorCDC). This is deferred, chunking is scalar for now.
+constexpr size_t ChunkSizeMin = 256;
+constexpr size_t ChunkSizeAvg = 1024;
+constexpr size_t ChunkSizeMax = 8192;
+
+class CContentChunker
+{
+protected:
+	uint64_t	m_nGearTable[256];
+	uint64_t	m_nMaskSmall;		// used below ChunkSizeAvg, harder to match
+	uint64_t	m_nMaskLarge;		// used above ChunkSizeAvg, easier to match
+
+public:
+	CContentChunker();
+
+	// returns the size of the chunk starting at buffer
+	size_t NextChunk(const char *buffer, size_t len) const;
+};
@@ -0,0 +1,164 @@
+/*
+ * This file is part of rdiff (https://github.com/thradde/rdiff).
+ * Copyright (c) 2025 Thorsten Radde.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "FileReader.h"
+
+
+CFileReader::CFileReader(const wchar_t *file_name, uint64_t min_size)
+	: m_pFileName(file_name)
+	, m_pFile(NULL)
+	, m_pBuffer(NULL)
+	, m_nSize(0)
+	, m_nRead(0)
+	, m_bDone(false)
+	, m_bError(false)
+	, m_nChecksum(0)
+{
+	// errors are reported right away, only reading is done in the background
+	m_pFile = OpenInputFile(file_name, m_nSize, min_size, m_pBuffer);
+}
+
+
+CFileReader::~CFileReader()
+{
+	if (m_pFile)
+		fclose(m_pFile);
+
+	free(m_pBuffer);
+}
+
+
+bool CFileReader::Read(const std::atomic<bool> &stop)
+{
+	CChecksumStream checksum;
+	uint64_t pos = 0;
+	while (pos < m_nSize)
+	{
+		if (stop)
+		{
+			SetError();
+			return false;
+		}
+
+		size_t len = (size_t)std::min<uint64_t>(ReadChunkSize, m_nSize - pos);
+		size_t n = fread(m_pBuffer + pos, 1, len, m_pFile);
+		if (n != len)
+		{
+			SetError();
+			return false;
+		}
+
+		checksum.Update(m_pBuffer + pos, len);
+		pos += len;
+
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_nRead = pos;
+		m_Cond.notify_all();
+	}
+
+	fclose(m_pFile);
+	m_pFile = NULL;
+
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_nChecksum = checksum.Digest();
+	m_bDone = true;
+	m_Cond.notify_all();
+	return true;
+}
+
+
+void CFileReader::SetError()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_bError = true;
+	m_Cond.notify_all();
+}
+
+
+// m_Mutex must be locked
+bool CFileReader::CheckError()
+{
+	// the error is only reported here, the caller returns and the CReaderThread destructors join
+	if (m_bError)
+	{
+		wprintf(L"fread() error on file %s\n", m_pFileName);
+		return false;
+	}
+
+	return true;
+}
+
+
+bool CFileReader::Wait(uint64_t &available)
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_Cond.wait(lock, [&] { return m_nRead > available || m_nRead == m_nSize || m_bError; });
+	if (!CheckError())
+		return false;
+
+	available = m_nRead;
+	return true;
+}
+
+
+bool CFileReader::Checksum(checksum_t &checksum)
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_Cond.wait(lock, [&] { return m_bDone || m_bError; });
+	if (!CheckError())
+		return false;
+
+	checksum = m_nChecksum;
+	return true;
+}
+
+
+CReaderThread::CReaderThread(const std::vector<CFileReader *> &files)
+	: m_vecFiles(files)
+	, m_bStop(false)
+{
+	m_Thread = std::thread(&CReaderThread::Run, this);
+}
+
+
+CReaderThread::~CReaderThread()
+{
+	m_bStop = true;
+	m_Thread.join();
+}
+
+
+void CReaderThread::Run()
+{
+	for (size_t f = 0; f < m_vecFiles.size(); f++)
+	{
+		if (!m_vecFiles[f]->Read(m_bStop))
+		{
+			// nobody must wait for the remaining files forever
+			for (f++; f < m_vecFiles.size(); f++)
+				m_vecFiles[f]->SetError();
+			return;
+		}
+	}
+}
@@ -0,0 +1,101 @@
+/*
+ * This file is part of rdiff (https://github.com/thradde/rdiff).
+ * Copyright (c) 2025 Thorsten Radde.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "utils.h"
+
+// Reads a file into memory, while other threads process the bytes read so far.
+//
+// The file is read in chunks of ReadChunkSize bytes by a CReaderThread and its checksum is computed on the fly.
+// So reading the old and the new file, computing their checksums and building the search map overlap.
+constexpr size_t ReadChunkSize = 8 * 1024 * 1024;
+
+class CFileReader
+{
+protected:
+	const wchar_t			*m_pFileName;
+	FILE					*m_pFile;
+	char					*m_pBuffer;
+	uint64_t				m_nSize;
+	uint64_t				m_nRead;		// bytes read so far, guarded by m_Mutex
+	bool					m_bDone;		// whole file read and checksum computed, guarded by m_Mutex
+	bool					m_bError;		// read error, guarded by m_Mutex
+	checksum_t				m_nChecksum;	// valid when m_bDone is set
+	std::mutex				m_Mutex;
+	std::condition_variable	m_Cond;
+
+	// reports a read error of the reader thread, returns false in that case
+	bool CheckError();
+
+public:
+	// exits, if the file can not be opened or is smaller than min_size
+	CFileReader(const wchar_t *file_name, uint64_t min_size);
+	~CFileReader();
+
+	char *Buffer() const
+	{
+		return m_pBuffer;
+	}
+
+	uint64_t Size() const
+	{
+		return m_nSize;
+	}
+
+	// Called by the reader thread, returns false on a read error or when stop is set.
+	// stop is checked between the chunks.
+	bool Read(const std::atomic<bool> &stop);
+
+	// Called by the reader thread, if the file can not be read, because a previous file failed.
+	void SetError();
+
+	// Waits until more than available bytes are read, or the whole file is read.
+	// Sets available to the number of bytes read. Returns false on a read error.
+	bool Wait(uint64_t &available);
+
+	// Waits until the whole file is read. Returns false on a read error.
+	bool Checksum(checksum_t &checksum);
+};
+
+
+// Reads files one after another on a thread of its own.
+// This bounds the number of threads and keeps the reads of one disk sequential.
+// The destructor stops reading after the current chunk and joins the thread,
+// so the main thread can return on an error without waiting for the remaining files.
+class CReaderThread
+{
+protected:
+	std::vector<CFileReader *>	m_vecFiles;
+	std::atomic<bool>			m_bStop;
+	std::thread					m_Thread;
+
+	void Run();
+
+public:
+	CReaderThread(const std::vector<CFileReader *> &files);
+	~CReaderThread();
+};
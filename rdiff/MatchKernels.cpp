@@ -0,0 +1,625 @@
+/*
+ * This file is part of rdiff (https://github.com/thradde/rdiff).
+ * Copyright (c) 2025 Thorsten Radde.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define MATCH_KERNELS_X86
+#endif
+
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+#ifdef MATCH_KERNELS_X86
+	#include <immintrin.h>
+#endif
+
+#include "utils.h"
+#include "MatchKernels.h"
+
+// MSVC allows intrinsics of any instruction set in any function,
+// gcc and clang must be told which functions may use them.
+#if defined(MATCH_KERNELS_X86) && !defined(_MSC_VER)
+	#define TARGET_AVX2		__attribute__((target("avx2")))
+	#define TARGET_AVX512	__attribute__((target("avx512f,avx512bw")))
+#else
+	#define TARGET_AVX2
+	#define TARGET_AVX512
+#endif
+
+
+// x != 0
+static inline unsigned CountTrailingZeros(uint64_t x)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, (uint32_t)x))
+		return index;
+	_BitScanForward(&index, (uint32_t)(x >> 32));
+	return index + 32;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+// x != 0
+static inline unsigned CountLeadingZeros(uint64_t x)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return 63 - index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanReverse(&index, (uint32_t)(x >> 32)))
+		return 31 - index;
+	_BitScanReverse(&index, (uint32_t)x);
+	return 63 - index;
+#else
+	return __builtin_clzll(x);
+#endif
+}
+
+static inline uint64_t Load64(const char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+
+// Portable kernels, compare 8 bytes at a time.
+// The byte order is little endian on all platforms rdiff is built for.
+static size_t MatchLengthForwardPortable(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n + 8 <= max_len)
+	{
+		uint64_t diff = Load64(a + n) ^ Load64(b + n);
+		if (diff)
+			return n + CountTrailingZeros(diff) / 8;
+		n += 8;
+	}
+
+	while (n < max_len && a[n] == b[n])
+		n++;
+
+	return n;
+}
+
+static size_t MatchLengthBackwardPortable(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n + 8 <= max_len)
+	{
+		uint64_t diff = Load64(a - n - 8) ^ Load64(b - n - 8);
+		if (diff)
+			return n + CountLeadingZeros(diff) / 8;
+		n += 8;
+	}
+
+	while (n < max_len && a[-(ptrdiff_t)n - 1] == b[-(ptrdiff_t)n - 1])
+		n++;
+
+	return n;
+}
+
+static uint64_t VerifyCandidatesPortable(const char *oldbuf, const TOffset *offsets, size_t count, const char *block, size_t block_size)
+{
+	uint64_t equal = 0;
+	if (block_size == 16)
+	{
+		uint64_t b0 = Load64(block);
+		uint64_t b1 = Load64(block + 8);
+		for (size_t n = 0; n < count; n++)
+		{
+			const char *p = oldbuf + offsets[n];
+			if (((Load64(p) ^ b0) | (Load64(p + 8) ^ b1)) == 0)
+				equal |= (uint64_t)1 << n;
+		}
+
+		return equal;
+	}
+
+	for (size_t n = 0; n < count; n++)
+	{
+		if (memcmp(oldbuf + offsets[n], block, block_size) == 0)
+			equal |= (uint64_t)1 << n;
+	}
+
+	return equal;
+}
+
+
+#ifdef MATCH_KERNELS_X86
+
+// SSE2 kernels, compare 16 bytes at a time.
+// Candidates are verified by the portable kernel, 2 word compares are as fast as 1 SSE2 compare.
+static size_t MatchLengthForwardSSE2(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n + 16 <= max_len)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + n));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + n));
+		uint32_t diff = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xffff;
+		if (diff)
+			return n + CountTrailingZeros(diff);
+		n += 16;
+	}
+
+	return n + MatchLengthForwardPortable(a + n, b + n, max_len - n);
+}
+
+static size_t MatchLengthBackwardSSE2(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n + 16 <= max_len)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i *)(a - n - 16));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b - n - 16));
+		uint32_t diff = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xffff;
+		if (diff)
+			return n + CountLeadingZeros(diff) - 48;
+		n += 16;
+	}
+
+	return n + MatchLengthBackwardPortable(a - n, b - n, max_len - n);
+}
+
+// AVX2 kernels, compare 32 bytes at a time, or 2 candidates at a time
+TARGET_AVX2 static size_t MatchLengthForwardAVX2(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n + 32 <= max_len)
+	{
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + n));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + n));
+		uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (diff)
+			return n + CountTrailingZeros(diff);
+		n += 32;
+	}
+
+	return n + MatchLengthForwardSSE2(a + n, b + n, max_len - n);
+}
+
+TARGET_AVX2 static size_t MatchLengthBackwardAVX2(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n + 32 <= max_len)
+	{
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a - n - 32));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b - n - 32));
+		uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (diff)
+			return n + CountLeadingZeros(diff) - 32;
+		n += 32;
+	}
+
+	return n + MatchLengthBackwardSSE2(a - n, b - n, max_len - n);
+}
+
+TARGET_AVX2 static uint64_t VerifyCandidatesAVX2(const char *oldbuf, const TOffset *offsets, size_t count, const char *block, size_t block_size)
+{
+	if (block_size != 16)
+		return VerifyCandidatesPortable(oldbuf, offsets, count, block, block_size);
+
+	__m256i vb = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)block));
+	uint64_t equal = 0;
+	size_t n = 0;
+	for (; n + 2 <= count; n += 2)
+	{
+		__m256i va = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(oldbuf + offsets[n]))),
+			_mm_loadu_si128((const __m128i *)(oldbuf + offsets[n + 1])), 1);
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if ((mask & 0xffff) == 0xffff)
+			equal |= (uint64_t)1 << n;
+		if ((mask >> 16) == 0xffff)
+			equal |= (uint64_t)1 << (n + 1);
+	}
+
+	if (n < count)
+		equal |= VerifyCandidatesPortable(oldbuf, offsets + n, count - n, block, block_size) << n;
+
+	return equal;
+}
+
+
+// AVX-512 kernels, compare 64 bytes at a time.
+// Candidates are verified with AVX2, gathering 4 candidates into one register is slower.
+TARGET_AVX512 static size_t MatchLengthForwardAVX512(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n + 64 <= max_len)
+	{
+		__m512i va = _mm512_loadu_si512((const void *)(a + n));
+		__m512i vb = _mm512_loadu_si512((const void *)(b + n));
+		uint64_t diff = _mm512_cmpneq_epi8_mask(va, vb);
+		if (diff)
+			return n + CountTrailingZeros(diff);
+		n += 64;
+	}
+
+	return n + MatchLengthForwardAVX2(a + n, b + n, max_len - n);
+}
+
+TARGET_AVX512 static size_t MatchLengthBackwardAVX512(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n + 64 <= max_len)
+	{
+		__m512i va = _mm512_loadu_si512((const void *)(a - n - 64));
+		__m512i vb = _mm512_loadu_si512((const void *)(b - n - 64));
+		uint64_t diff = _mm512_cmpneq_epi8_mask(va, vb);
+		if (diff)
+			return n + CountLeadingZeros(diff);
+		n += 64;
+	}
+
+	return n + MatchLengthBackwardAVX2(a - n, b - n, max_len - n);
+}
+
+#endif	// MATCH_KERNELS_X86
+
+
+enum
+{
+	KernelsPortable,
+	KernelsSSE2,
+	KernelsAVX2,
+	KernelsAVX512,
+};
+
+static int SelectKernels()
+{
+#ifdef MATCH_KERNELS_X86
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 0);
+	int max_leaf = regs[0];
+
+	__cpuid(regs, 1);
+	bool sse2 = (regs[3] & (1 << 26)) != 0;
+	bool osxsave = (regs[2] & (1 << 27)) != 0;
+	bool avx = (regs[2] & (1 << 28)) != 0;
+
+	bool avx2 = false;
+	bool avx512 = false;
+	if (max_leaf >= 7 && osxsave && avx)
+	{
+		// the OS must save the YMM (and ZMM) registers on context switches
+		uint64_t xcr0 = _xgetbv(0);
+		__cpuidex(regs, 7, 0);
+		avx2 = (xcr0 & 0x06) == 0x06 && (regs[1] & (1 << 5)) != 0;
+		avx512 = (xcr0 & 0xe6) == 0xe6 && (regs[1] & (1 << 16)) != 0 && (regs[1] & (1 << 30)) != 0;
+	}
+#else
+	__builtin_cpu_init();
+	bool sse2 = __builtin_cpu_supports("sse2");
+	bool avx2 = __builtin_cpu_supports("avx2");
+	bool avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+
+	if (avx512)
+		return KernelsAVX512;
+	if (avx2)
+		return KernelsAVX2;
+	if (sse2)
+		return KernelsSSE2;
+#endif
+
+	return KernelsPortable;
+}
+
+static const int gKernels = SelectKernels();
+
+
+// Most matches of executables are short, and for these the word compares have the lowest latency.
+// So the first ShortMatchSize bytes are compared 8 bytes at a time, before the vector kernels take over.
+constexpr size_t ShortMatchSize = 32;
+
+size_t MatchLengthForward(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n + 8 <= max_len && n < ShortMatchSize)
+	{
+		uint64_t diff = Load64(a + n) ^ Load64(b + n);
+		if (diff)
+			return n + CountTrailingZeros(diff) / 8;
+		n += 8;
+	}
+
+	a += n;
+	b += n;
+	max_len -= n;
+	switch (gKernels)
+	{
+#ifdef MATCH_KERNELS_X86
+	case KernelsAVX512:	return n + MatchLengthForwardAVX512(a, b, max_len);
+	case KernelsAVX2:	return n + MatchLengthForwardAVX2(a, b, max_len);
+	case KernelsSSE2:	return n + MatchLengthForwardSSE2(a, b, max_len);
+#endif
+	default:			return n + MatchLengthForwardPortable(a, b, max_len);
+	}
+}
+
+size_t MatchLengthBackward(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n + 8 <= max_len && n < ShortMatchSize)
+	{
+		uint64_t diff = Load64(a - n - 8) ^ Load64(b - n - 8);
+		if (diff)
+			return n + CountLeadingZeros(diff) / 8;
+		n += 8;
+	}
+
+	a -= n;
+	b -= n;
+	max_len -= n;
+	switch (gKernels)
+	{
+#ifdef MATCH_KERNELS_X86
+	case KernelsAVX512:	return n + MatchLengthBackwardAVX512(a, b, max_len);
+	case KernelsAVX2:	return n + MatchLengthBackwardAVX2(a, b, max_len);
+	case KernelsSSE2:	return n + MatchLengthBackwardSSE2(a, b, max_len);
+#endif
+	default:			return n + MatchLengthBackwardPortable(a, b, max_len);
+	}
+}
+
+uint64_t VerifyCandidates(const char *oldbuf, const TOffset *offsets, size_t count, const char *block, size_t block_size)
+{
+	switch (gKernels)
+	{
+#ifdef MATCH_KERNELS_X86
+	case KernelsAVX512:
+	case KernelsAVX2:	return VerifyCandidatesAVX2(oldbuf, offsets, count, block, block_size);
+#endif
+	default:			return VerifyCandidatesPortable(oldbuf, offsets, count, block, block_size);
+	}
+}
+
+const char *MatchKernelsName()
+{
+	switch (gKernels)
+	{
+	case KernelsAVX512:	return "AVX-512";
+	case KernelsAVX2:	return "AVX2";
+	case KernelsSSE2:	return "SSE2";
+	default:			return "portable";
+	}
+}
+
+
+#ifdef MATCH_KERNELS_BENCH
+
+// Microbenchmark of the kernels against the scalar loops they replace.
+// Build it as a console program of its own, e.g.
+//
+//		cl /O2 /EHsc /DMATCH_KERNELS_BENCH MatchKernels.cpp
+//		g++ -O2 -DMATCH_KERNELS_BENCH MatchKernels.cpp
+//
+// All implementations the CPU supports are checked against the scalar loops first.
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+typedef size_t (*TMatchLengthFunc)(const char *a, const char *b, size_t max_len);
+typedef uint64_t (*TVerifyFunc)(const char *oldbuf, const TOffset *offsets, size_t count, const char *block, size_t block_size);
+
+// the loop of pass 2 before the kernels
+static size_t MatchLengthForwardScalar(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n < max_len)
+	{
+		if (a[n] != b[n])
+			break;
+		n++;
+	}
+
+	return n;
+}
+
+static size_t MatchLengthBackwardScalar(const char *a, const char *b, size_t max_len)
+{
+	size_t n = 0;
+	while (n < max_len && a[-(ptrdiff_t)n - 1] == b[-(ptrdiff_t)n - 1])
+		n++;
+
+	return n;
+}
+
+static uint64_t VerifyCandidatesScalar(const char *oldbuf, const TOffset *offsets, size_t count, const char *block, size_t block_size)
+{
+	uint64_t equal = 0;
+	for (size_t n = 0; n < count; n++)
+	{
+		if (memcmp(oldbuf + offsets[n], block, block_size) == 0)
+			equal |= (uint64_t)1 << n;
+	}
+
+	return equal;
+}
+
+static uint64_t gRandom = 0x9e3779b97f4a7c15;
+
+static uint32_t Random()
+{
+	gRandom ^= gRandom << 13;
+	gRandom ^= gRandom >> 7;
+	gRandom ^= gRandom << 17;
+	return (uint32_t)gRandom;
+}
+
+struct CKernel
+{
+	const char			*m_pName;
+	int					m_nLevel;
+	TMatchLengthFunc	m_pForward;
+	TMatchLengthFunc	m_pBackward;
+	TVerifyFunc			m_pVerify;
+};
+
+static const CKernel gBenchKernels[] =
+{
+	{ "scalar",		KernelsPortable,	MatchLengthForwardScalar,	MatchLengthBackwardScalar,	VerifyCandidatesScalar },
+	{ "portable",	KernelsPortable,	MatchLengthForwardPortable,	MatchLengthBackwardPortable,	VerifyCandidatesPortable },
+#ifdef MATCH_KERNELS_X86
+	{ "SSE2",		KernelsSSE2,		MatchLengthForwardSSE2,		MatchLengthBackwardSSE2,	VerifyCandidatesPortable },
+	{ "AVX2",		KernelsAVX2,		MatchLengthForwardAVX2,		MatchLengthBackwardAVX2,	VerifyCandidatesAVX2 },
+	{ "AVX-512",	KernelsAVX512,		MatchLengthForwardAVX512,	MatchLengthBackwardAVX512,	VerifyCandidatesAVX2 },
+#endif
+	{ "dispatched",	KernelsPortable,	MatchLengthForward,			MatchLengthBackward,		VerifyCandidates },
+};
+
+// Extends matches of match_size bytes one after another over the whole buffer, like pass 2 does.
+// Returns GB/s.
+static double BenchForward(TMatchLengthFunc func, const char *a, const char *b, size_t size, size_t match_size)
+{
+	const int rounds = 20;
+	size_t total = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++)
+	{
+		size_t i = 0;
+		while (i + match_size + 1 < size)
+		{
+			size_t len = func(a + i, b + i, size - i);
+			total += len;
+			i += len + 1;
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return total / seconds / 1e9;
+}
+
+int main()
+{
+	printf("selected kernels: %s\n\n", MatchKernelsName());
+
+	const size_t size = 1 << 20;
+	std::vector<char> a(size), b(size);
+	for (size_t n = 0; n < size; n++)
+		a[n] = (char)Random();
+
+	const size_t kernel_count = sizeof(gBenchKernels) / sizeof(gBenchKernels[0]);
+
+	// correctness against the scalar loops
+	for (int t = 0; t < 20000; t++)
+	{
+		b = a;
+		size_t pos = 1024 + Random() % (size - 4096);
+		size_t max_len = Random() % 2048;
+		size_t diff = pos - 1024 + Random() % 2048;
+		b[diff] ^= (char)(1 + Random() % 255);
+
+		size_t expect_fwd = MatchLengthForwardScalar(&a[pos], &b[pos], max_len);
+		size_t expect_bwd = MatchLengthBackwardScalar(&a[pos], &b[pos], std::min(max_len, pos));
+		for (size_t k = 1; k < kernel_count; k++)
+		{
+			if (gBenchKernels[k].m_nLevel > gKernels)
+				continue;
+			if (gBenchKernels[k].m_pForward(&a[pos], &b[pos], max_len) != expect_fwd
+				|| gBenchKernels[k].m_pBackward(&a[pos], &b[pos], std::min(max_len, pos)) != expect_bwd)
+			{
+				printf("%s: match length mismatch\n", gBenchKernels[k].m_pName);
+				return 1;
+			}
+		}
+
+		TOffset offsets[64];
+		size_t count = 1 + Random() % 64;
+		const char *block = &a[Random() % (size - 16)];
+		for (size_t n = 0; n < count; n++)
+			offsets[n] = (Random() % 3 == 0) ? (TOffset)(block - &a[0]) : (TOffset)(Random() % (size - 16));
+
+		uint64_t expect_equal = VerifyCandidatesScalar(&a[0], offsets, count, block, 16);
+		for (size_t k = 1; k < kernel_count; k++)
+		{
+			if (gBenchKernels[k].m_nLevel <= gKernels && gBenchKernels[k].m_pVerify(&a[0], offsets, count, block, 16) != expect_equal)
+			{
+				printf("%s: verify mismatch\n", gBenchKernels[k].m_pName);
+				return 1;
+			}
+		}
+	}
+	printf("all kernels match the scalar loops\n\n");
+
+	// match extension
+	printf("forward match extension, GB/s\n");
+	printf("%-12s", "match size");
+	for (size_t k = 0; k < kernel_count; k++)
+	{
+		if (gBenchKernels[k].m_nLevel <= gKernels)
+			printf("%12s", gBenchKernels[k].m_pName);
+	}
+	printf("\n");
+
+	const size_t match_sizes[] = { 8, 32, 100, 1000, 100000 };
+	for (size_t match_size : match_sizes)
+	{
+		b = a;
+		for (size_t n = match_size; n < size; n += match_size + 1)
+			b[n] ^= 1;
+
+		printf("%-12zu", match_size);
+		for (size_t k = 0; k < kernel_count; k++)
+		{
+			if (gBenchKernels[k].m_nLevel <= gKernels)
+				printf("%12.2f", BenchForward(gBenchKernels[k].m_pForward, &a[0], &b[0], size, match_size));
+		}
+		printf("\n");
+	}
+
+	// candidate verification, 64 candidates of one bucket
+	printf("\nverify 64 candidates, ns\n");
+	TOffset offsets[64];
+	for (size_t n = 0; n < 64; n++)
+		offsets[n] = Random() % (size - 16);
+
+	const int rounds = 200000;
+	uint64_t sink = 0;
+	for (size_t k = 0; k < kernel_count; k++)
+	{
+		if (gBenchKernels[k].m_nLevel > gKernels)
+			continue;
+
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < rounds; r++)
+			sink += gBenchKernels[k].m_pVerify(&a[0], offsets, 64, &a[r & 1023], 16);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		printf("%-12s%12.1f\n", gBenchKernels[k].m_pName, seconds / rounds * 1e9);
+	}
+
+	// use the results, so the compiler can not drop the verify calls
+	return sink == 0x7fffffffffffffff;
+}
+
+#endif	// MATCH_KERNELS_BENCH
@@ -0,0 +1,35 @@
+/*
+ * This file is part of rdiff (https://github.com/thradde/rdiff).
+ * Copyright (c) 2025 Thorsten Radde.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compare kernels for verifying and extending matches.
+//
+// The implementation is selected at runtime by the features of the CPU:
+// AVX-512, AVX2, SSE2 or a portable version comparing 8 bytes at a time.
+
+// Returns the number of equal bytes at the start of a and b, at most max_len.
+size_t MatchLengthForward(const char *a, const char *b, size_t max_len);
+
+// Returns the number of equal bytes in front of a and b, i.e. a[-1] == b[-1], a[-2] == b[-2], ...,
+// at most max_len.
+size_t MatchLengthBackward(const char *a, const char *b, size_t max_len);
+
+// Compares the block_size bytes at block with the bytes at oldbuf + offsets[n] for up to 64 candidates.
+// Bit n of the result is set, if candidate n is equal.
+uint64_t VerifyCandidates(const char *oldbuf, const TOffset *offsets, size_t count, const char *block, size_t block_size);
+
+// Name of the selected implementation, for information only
+const char *MatchKernelsName();
@@ -16,7 +16,9 @@
  */
 
 #define PATCH_FILE_MAGIC	0x20241118
-#define PATCH_FILE_VERSION	1
+#define PATCH_FILE_VERSION_SINGLE		1	// copies from the old file only
+#define PATCH_FILE_VERSION_BASE_FILES	2	// copies from additional base files, see BlockTypeCopyFile
+#define PATCH_FILE_VERSION				PATCH_FILE_VERSION_BASE_FILES	// highest version rpatch can apply
 
 class CPatchFileHeader
 {
@@ -29,9 +31,9 @@ public:
 	checksum_t	m_nNewChecksum;	// checksum of new file
 
 public:
-	CPatchFileHeader(uint64_t file_size, uint32_t offset_size, checksum_t chk_old, checksum_t chk_new)
+	CPatchFileHeader(uint64_t file_size, uint32_t offset_size, checksum_t chk_old, checksum_t chk_new, uint32_t version = PATCH_FILE_VERSION_SINGLE)
 		: m_nMagic(PATCH_FILE_MAGIC)
-		, m_nVersion(PATCH_FILE_VERSION)
+		, m_nVersion(version)
 		, m_nFileSize(file_size)
 		, m_nOffsetSize(offset_size)
 		, m_nOldChecksum(chk_old)
@@ -51,6 +53,14 @@ public:
 };
 
 
+// Version 2 only: the header is followed by
+//
+// number of base files (uint32_t)
+// checksum of each base file
+//
+// Base files are additional old files given to rdiff and rpatch with --base.
+
+
 // Block header
 //
 // BlockTypeCopy
@@ -62,8 +72,16 @@ public:
 // BlockTypeInsert
 // size
 // ... data ...
+//
+// or (version 2 only)
+//
+// BlockTypeCopyFile
+// file id (uint32_t), 0 = old file, 1.. = base files in command line order
+// old offset
+// size
 enum
 {
 	BlockTypeCopy,		// copy from old file
 	BlockTypeInsert,	// insert new
+	BlockTypeCopyFile,	// copy from old file or base file
 };
@@ -112,9 +112,16 @@ original file 2,715 KB, so the patch file is only about 10% in size.
 #include <string>
 #include <list>
 #include <map>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <iterator>
 
 #include "utils.h"
 #include "PatchFileHeader.h"
+#include "ContentChunker.h"
+#include "MatchKernels.h"
+#include "FileReader.h"
 
 //#define VERBOSE
 
@@ -137,18 +144,40 @@ public:
 std::map<checksum_t, CSearchNode *> gSearchMap;
 
 
+// A chunk of an old file, stored in the chunk map
+class CChunkRef
+{
+public:
+	uint32_t	m_nFileId;		// 0 = old file, 1.. = base files
+	TOffset		m_nOffset;		// offset of chunk in its file
+	TOffset		m_nSize;		// size of chunk
+
+public:
+	CChunkRef(uint32_t file_id, TOffset offset, TOffset size)
+		: m_nFileId(file_id)
+		, m_nOffset(offset)
+		, m_nSize(size)
+	{
+	}
+};
+
+std::map<checksum_t, std::list<CChunkRef>> gChunkMap;
+
+
 class CBlock
 {
 public:
-	TOffset	m_nNewOffset;		// offset in new file where this block is located
-	TOffset	m_nSize;			// size of block
-	TOffset	m_nOldOffset;		// offset in old file where this block is located
+	TOffset		m_nNewOffset;		// offset in new file where this block is located
+	TOffset		m_nSize;			// size of block
+	TOffset		m_nOldOffset;		// offset in old file where this block is located
+	uint32_t	m_nFileId;			// file to copy from, 0 = old file, 1.. = base files
 
 public:
-	CBlock(TOffset new_off, TOffset size, TOffset old_off)
+	CBlock(TOffset new_off, TOffset size, TOffset old_off, uint32_t file_id = 0)
 		: m_nNewOffset(new_off)
 		, m_nSize(size)
 		, m_nOldOffset(old_off)
+		, m_nFileId(file_id)
 	{
 	}
 };
@@ -159,40 +188,46 @@ typedef std::list<CBlock>::iterator TBlockListIter;
 constexpr size_t BlockSize = 16;
 
 
-int wmain(int argc, const wchar_t **argv)
+// Parse levels, selected with --level
+//
+// 0 = greedy: take the first candidate that matches, extend forward only (default, fastest)
+// 1 = lazy: take the longest candidate, extend backward into the pending insert,
+//     and defer a match by one byte if the next position yields a longer one
+// 2 = optimal: shortest-path parse over all candidate matches, minimizing the size of the
+//     uncompressed ops according to the cost model below. After LZMA compression the patch
+//     is usually within 0.2% of level 1, at 2-3 times the run time.
+constexpr int ParseLevelGreedy = 0;
+constexpr int ParseLevelLazy = 1;
+constexpr int ParseLevelOptimal = 2;
+
+// Cost model used by the optimal parse, in bytes of the uncompressed patch file.
+// LZMA compresses the patch afterwards, which the model does not account for.
+// Lower op costs were tried as an estimate of the compressed size, without a measurable gain.
+constexpr uint64_t CopyOpCost = sizeof(char) + 2 * sizeof(TOffset);	// cmd, old offset, size
+constexpr uint64_t InsertOpCost = sizeof(char) + sizeof(TOffset);		// cmd, size
+constexpr uint64_t LiteralCost = 1;
+
+// Limit the number of candidates checked per hash hit for levels >= 1.
+// Without it, regions like long runs of zero bytes make the search quadratic.
+constexpr size_t MaxCandidates = 64;
+
+// Matches of at least this size are taken immediately by the optimal parse.
+// This bounds the work per position, a longer search would gain next to nothing.
+constexpr TOffset SufficientMatchSize = 1024;
+
+// The optimal parse keeps one node per position of the new file, but only within a window
+// of this size. After the window the parse is resolved at the next position, where this
+// loses nothing, and starts over. If there is none within ParseWindowSlack, it is resolved anyway.
+constexpr TOffset ParseWindowSize = 256 * 1024;
+constexpr TOffset ParseWindowSlack = 16 * 1024;
+
+
+// Compute search map for old file.
+// Adds the blocks within the first available bytes, starting at block offset i,
+// so the search map can be built while the old file is being read.
+static void BuildSearchMap(const char *oldbuf, uint64_t old_size, uint64_t available, TOffset &i)
 {
-	const wchar_t *oldfile;
-	const wchar_t *newfile;
-	const wchar_t *patchfile;
-
-#ifdef TEST_VPE
-	oldfile = L"F:\\tmp\\test rdiff\\vpee3270.dll";
-	newfile = L"F:\\tmp\\test rdiff\\vpee3271.dll";
-	patchfile = L"F:\\tmp\\test rdiff\\vpe.patch";
-#else
-	if (argc != 4)
-	{
-		printf("usage: rdiff <oldfile> <newfile> <patchfile>\n");
-		exit(1);
-	}
-	oldfile = argv[1];
-	newfile = argv[2];
-	patchfile = argv[3];
-#endif
-
-	// read files into memory
-	uint64_t old_size, new_size;
-	char *oldbuf = ReadFile(oldfile, old_size, BlockSize);
-	char *newbuf = ReadFile(newfile, new_size, BlockSize);
-
-	// compute checksums
-	checksum_t chk_old = ComputeChecksum(oldbuf, old_size);
-	checksum_t chk_new = ComputeChecksum(newbuf, new_size);
-
-	// compute search map for old file
-	wprintf(L"pass 1, computing search map\n");
-	TOffset i = 0;
-	while (i < old_size - BlockSize)
+	while (i < old_size - BlockSize && i + BlockSize <= available)
 	{
 		checksum_t csum = ComputeChecksum(oldbuf + i, BlockSize);
 
@@ -213,9 +248,55 @@ int wmain(int argc, const wchar_t **argv)
 
 		i++;
 	}
+}
 
-	wprintf(L"pass 2, search identical blocks in new file\n");
+
+// Find the longest match for new file offset k among all candidates of the search map.
+// Returns the size of the match (0 if none) and its offset in the old file in old_off.
+static TOffset FindLongestMatch(const char *oldbuf, uint64_t old_size, const char *newbuf, uint64_t new_size,
+	TOffset k, TOffset max_size, TOffset &old_off)
+{
+	TOffset best_size = 0;
+
+	checksum_t csum = ComputeChecksum(newbuf + k, BlockSize);
+	auto it = gSearchMap.find(csum);
+	if (it == gSearchMap.end())
+		return 0;
+
+	// verify all candidates at once
+	TOffset candidates[MaxCandidates];
+	size_t count = 0;
+	for (auto it_off = it->second->m_listOffsets.begin(); it_off != it->second->m_listOffsets.end() && count < MaxCandidates; it_off++)
+		candidates[count++] = *it_off;
+
+	uint64_t equal = VerifyCandidates(oldbuf, candidates, count, newbuf + k, BlockSize);
+	for (size_t n = 0; n < count; n++)
+	{
+		if (!(equal & ((uint64_t)1 << n)))
+			continue;
+
+		TOffset i = candidates[n];
+		uint64_t max_len = std::min<uint64_t>(std::min(old_size - i, new_size - k), max_size);
+		TOffset size = BlockSize + (TOffset)MatchLengthForward(oldbuf + i + BlockSize, newbuf + k + BlockSize, max_len - BlockSize);
+		if (size > best_size)
+		{
+			best_size = size;
+			old_off = i;
+			if (best_size >= max_size)
+				break;
+		}
+	}
+
+	return best_size;
+}
+
+
+// Level 0: greedy, take the first candidate that matches and extend it forward.
+// Returns the number of bytes to copy.
+static uint64_t GreedyParse(const char *oldbuf, uint64_t old_size, const char *newbuf, uint64_t new_size)
+{
 	uint64_t total_size_to_copy = 0;
+	TOffset i;
 	TOffset k = 0;
 	while (k < new_size - BlockSize)
 	{
@@ -224,26 +305,32 @@ int wmain(int argc, const wchar_t **argv)
 		auto it = gSearchMap.find(csum);
 		if (it != gSearchMap.end())
 		{
-			// found in search map, now compare each block byte for byte
-			for (auto it_off = it->second->m_listOffsets.begin(); it_off != it->second->m_listOffsets.end(); it_off++)
+			// found in search map, now compare the candidates in batches,
+			// the first equal one is taken
+			std::list<TOffset> &offsets = it->second->m_listOffsets;
+			auto it_off = offsets.begin();
+			while (it_off != offsets.end())
 			{
-				i = *it_off;
-				if (memcmp(oldbuf + i, newbuf + k, BlockSize) != 0)
+				TOffset candidates[MaxCandidates];
+				auto it_batch = it_off;
+				size_t count = 0;
+				while (it_off != offsets.end() && count < MaxCandidates)
+					candidates[count++] = *it_off++;
+
+				uint64_t equal = VerifyCandidates(oldbuf, candidates, count, newbuf + k, BlockSize);
+				if (!equal)
 					continue;
 
+				size_t n = 0;
+				while (!(equal & ((uint64_t)1 << n)))
+					n++;
+				std::advance(it_batch, n);
+				i = candidates[n];
+
 				// identical block found in new file
 				// check, if there are additional equal bytes
-				TOffset ii = i + BlockSize;
-				TOffset kk = k + BlockSize;
-				while (ii < old_size && kk < new_size)
-				{
-					if (*(oldbuf + ii) != *(newbuf + kk))
-						break;
-					ii++;
-					kk++;
-				}
-
-				TOffset size = ii - i;
+				uint64_t max_len = std::min(old_size - i, new_size - k);
+				TOffset size = BlockSize + (TOffset)MatchLengthForward(oldbuf + i + BlockSize, newbuf + k + BlockSize, max_len - BlockSize);
 				gBlockList.emplace_back(k, size, i);
 #ifdef VERBOSE
 				wprintf(L"identical block found.\n"
@@ -256,7 +343,7 @@ int wmain(int argc, const wchar_t **argv)
 				total_size_to_copy += size;
 
 				// remove entry from search-map
-				it->second->m_listOffsets.erase(it_off);
+				offsets.erase(it_batch);
 				break;
 			}
 		}
@@ -264,8 +351,556 @@ int wmain(int argc, const wchar_t **argv)
 		k++;
 	}
 
+	return total_size_to_copy;
+}
+
+
+// Level 1: lazy matching with backward extension.
+// Returns the number of bytes to copy.
+static uint64_t LazyParse(const char *oldbuf, uint64_t old_size, const char *newbuf, uint64_t new_size)
+{
+	uint64_t total_size_to_copy = 0;
+	TOffset insert_start = 0;		// start of the pending insert, i.e. end of the previous block
+	TOffset k = 0;
+	TOffset i;
+	bool have_next = false;		// match at k was already found by the lookahead of the previous position
+	TOffset next_i = 0;
+	TOffset next_size = 0;
+	while (k < new_size - BlockSize)
+	{
+		TOffset size;
+		if (have_next)
+		{
+			size = next_size;
+			i = next_i;
+			have_next = false;
+		}
+		else
+			size = FindLongestMatch(oldbuf, old_size, newbuf, new_size, k, (TOffset)new_size, i);
+		if (size == 0)
+		{
+			k++;
+			continue;
+		}
+
+		// lazy evaluation: prefer the next position, if it gives a longer match
+		if (k + 1 < new_size - BlockSize)
+		{
+			next_size = FindLongestMatch(oldbuf, old_size, newbuf, new_size, k + 1, (TOffset)new_size, next_i);
+			if (next_size > size + 1)
+			{
+				have_next = true;
+				k++;
+				continue;
+			}
+		}
+
+		// extend backward into the pending insert
+		TOffset back = (TOffset)MatchLengthBackward(oldbuf + i, newbuf + k, std::min(k - insert_start, i));
+		i -= back;
+		k -= back;
+		size += back;
+
+		gBlockList.emplace_back(k, size, i);
+		k += size;
+		total_size_to_copy += size;
+		insert_start = k;
+	}
+
+	return total_size_to_copy;
+}
+
+
+// Node of the optimal parse, one per position in the new file
+class CParseNode
+{
+public:
+	uint64_t	m_nCostCopy;		// cost to reach this position with a copy op as last op
+	uint64_t	m_nCostInsert;		// cost to reach this position inside an insert op
+	TOffset		m_nCopyFrom;		// start of the copy op in the new file
+	TOffset		m_nCopyOldOffset;	// offset of the copy op in the old file
+	bool		m_bCopyAfterInsert;	// copy op follows an insert op
+	bool		m_bInsertAfterCopy;	// literal starts a new insert op
+
+public:
+	CParseNode()
+		: m_nCostCopy(UINT64_MAX)
+		, m_nCostInsert(UINT64_MAX)
+		, m_nCopyFrom(0)
+		, m_nCopyOldOffset(0)
+		, m_bCopyAfterInsert(false)
+		, m_bInsertAfterCopy(false)
+	{
+	}
+};
+
+
+// Append a copy op to the block list of the optimal parse.
+// A copy continuing the previous one in both files is merged into it.
+// This happens at segment boundaries, where a copy crossing the boundary is split.
+static void AppendBlock(std::list<CBlock> &blocks, const CBlock &block)
+{
+	if (!blocks.empty())
+	{
+		CBlock &prev = blocks.back();
+		if (prev.m_nFileId == block.m_nFileId
+			&& prev.m_nNewOffset + prev.m_nSize == block.m_nNewOffset
+			&& prev.m_nOldOffset + prev.m_nSize == block.m_nOldOffset)
+		{
+			prev.m_nSize += block.m_nSize;
+			return;
+		}
+	}
+
+	blocks.push_back(block);
+}
+
+
+// Walk back from the end of a parsed segment and append its copy ops to the block list.
+// in_copy selects the state the segment ends in.
+// Returns the number of bytes to copy.
+static uint64_t ResolveSegment(std::vector<CParseNode> &nodes, TOffset seg_start, TOffset seg_end, bool in_copy, std::list<CBlock> &blocks)
+{
+	uint64_t total_size_to_copy = 0;
+	std::list<CBlock> seg_blocks;
+	TOffset k = seg_end;
+	while (k > seg_start)
+	{
+		const CParseNode &node = nodes[k - seg_start];
+		if (in_copy)
+		{
+			TOffset size = k - node.m_nCopyFrom;
+			seg_blocks.emplace_front(node.m_nCopyFrom, size, node.m_nCopyOldOffset);
+			total_size_to_copy += size;
+			in_copy = !node.m_bCopyAfterInsert;
+			k = node.m_nCopyFrom;
+		}
+		else
+		{
+			in_copy = node.m_bInsertAfterCopy;
+			k--;
+		}
+	}
+
+	for (auto &block : seg_blocks)
+		AppendBlock(blocks, block);
+	return total_size_to_copy;
+}
+
+
+// Level 2: optimal parse.
+//
+// Computes the cheapest sequence of copy and insert ops according to the cost model by a
+// shortest-path search over the new file. For each position two costs are tracked:
+// reaching it with a copy op as last op, and reaching it inside an insert op,
+// because continuing an insert costs a literal only, while starting one costs the op header, too.
+//
+// Whenever a match of at least SufficientMatchSize is found, it is taken immediately and the
+// segment parsed so far is resolved. Copies of earlier positions reaching into the long match are dropped.
+// A segment is resolved as well after ParseWindowSize, at the first position no copy reaches beyond
+// and whose one state is at least as good for the rest of the file as the other:
+// continuing an insert is never more expensive than starting one after a copy,
+// and starting one costs InsertOpCost more at most. So resolving there gives the same result as
+// an unbounded parse. Only if there is no such position within ParseWindowSlack, the segment is
+// resolved in its cheaper state and copies reaching beyond are split or dropped.
+// So at most ParseWindowSize + ParseWindowSlack + SufficientMatchSize nodes exist, i.e. about 9 MB,
+// independent of the file size.
+// Returns the number of bytes to copy.
+static uint64_t OptimalParse(const char *oldbuf, uint64_t old_size, const char *newbuf, uint64_t new_size)
+{
+	uint64_t total_size_to_copy = 0;
+	std::vector<CParseNode> nodes;
+	nodes.reserve((size_t)ParseWindowSize + ParseWindowSlack + SufficientMatchSize + 1);
+
+	TOffset seg_start = 0;
+	nodes.resize(1);
+	nodes[0].m_nCostCopy = 0;		// start of file or after a copy op, no insert is pending
+
+	TOffset k = 0;
+	while (k < new_size)
+	{
+		if (k - seg_start >= ParseWindowSize)
+		{
+			// end of window, resolve where the state to carry over to the next segment is clear
+			const CParseNode &node = nodes[k - seg_start];
+			bool no_copy_beyond = nodes.size() == (size_t)(k - seg_start) + 1;
+			bool insert_is_best = node.m_nCostInsert <= node.m_nCostCopy;
+			bool copy_is_best = node.m_nCostCopy != UINT64_MAX && node.m_nCostCopy + InsertOpCost <= node.m_nCostInsert;
+			if ((no_copy_beyond && (insert_is_best || copy_is_best)) || k - seg_start == ParseWindowSize + ParseWindowSlack)
+			{
+				bool in_insert = node.m_nCostInsert < node.m_nCostCopy;
+				total_size_to_copy += ResolveSegment(nodes, seg_start, k, !in_insert, gBlockList);
+
+				seg_start = k;
+				nodes.clear();
+				nodes.resize(1);
+				if (in_insert)
+					nodes[0].m_nCostInsert = 0;		// the pending insert is continued
+				else
+					nodes[0].m_nCostCopy = 0;
+			}
+		}
+
+		TOffset i;
+		TOffset size = 0;
+		if (k < new_size - BlockSize)
+			size = FindLongestMatch(oldbuf, old_size, newbuf, new_size, k, SufficientMatchSize, i);
+
+		if (size >= SufficientMatchSize)
+		{
+			// take the long match immediately and resolve the segment parsed so far
+			total_size_to_copy += ResolveSegment(nodes, seg_start, k, nodes[k - seg_start].m_nCostCopy <= nodes[k - seg_start].m_nCostInsert, gBlockList);
+
+			// extend the match to its full size
+			size += (TOffset)MatchLengthForward(oldbuf + i + size, newbuf + k + size, std::min(old_size - i, new_size - k) - size);
+			AppendBlock(gBlockList, CBlock(k, size, i));
+			total_size_to_copy += size;
+
+			k += size;
+			seg_start = k;
+			nodes.clear();
+			nodes.resize(1);
+			nodes[0].m_nCostCopy = 0;
+			continue;
+		}
+
+		if (nodes.size() < (size_t)(k - seg_start) + std::max<TOffset>(size, 1) + 1)
+			nodes.resize((size_t)(k - seg_start) + std::max<TOffset>(size, 1) + 1);
+		CParseNode &cur = nodes[k - seg_start];
+		uint64_t cost = std::min(cur.m_nCostCopy, cur.m_nCostInsert);
+
+		// relax literal
+		CParseNode &next = nodes[k - seg_start + 1];
+		if (cur.m_nCostInsert != UINT64_MAX && cur.m_nCostInsert + LiteralCost < next.m_nCostInsert)
+		{
+			next.m_nCostInsert = cur.m_nCostInsert + LiteralCost;
+			next.m_bInsertAfterCopy = false;
+		}
+		if (cur.m_nCostCopy != UINT64_MAX && cur.m_nCostCopy + InsertOpCost + LiteralCost < next.m_nCostInsert)
+		{
+			next.m_nCostInsert = cur.m_nCostCopy + InsertOpCost + LiteralCost;
+			next.m_bInsertAfterCopy = true;
+		}
+
+		// relax copies of all sizes of the match
+		bool after_insert = cur.m_nCostInsert < cur.m_nCostCopy;
+		for (TOffset len = BlockSize; len <= size; len++)
+		{
+			CParseNode &target = nodes[k - seg_start + len];
+			if (cost + CopyOpCost < target.m_nCostCopy)
+			{
+				target.m_nCostCopy = cost + CopyOpCost;
+				target.m_nCopyFrom = k;
+				target.m_nCopyOldOffset = i;
+				target.m_bCopyAfterInsert = after_insert;
+			}
+		}
+
+		k++;
+	}
+
+	total_size_to_copy += ResolveSegment(nodes, seg_start, k, nodes[k - seg_start].m_nCostCopy <= nodes[k - seg_start].m_nCostInsert, gBlockList);
+	return total_size_to_copy;
+}
+
+
+// Content-defined chunking mode (--cdc), pass 1.
+// Splits the old file and all base files into chunks and stores them in one global chunk map.
+// Adds the chunks of file_id within the first available bytes, starting at offset i,
+// so the chunk map can be built while the file is being read.
+static void BuildChunkMap(const CContentChunker &chunker, uint32_t file_id, const char *oldbuf, uint64_t old_size, uint64_t available, TOffset &i)
+{
+	// a chunk boundary can only be found, if ChunkSizeMax bytes or the end of the file are available
+	while (i < old_size && (i + ChunkSizeMax <= available || available == old_size))
+	{
+		TOffset size = (TOffset)chunker.NextChunk(oldbuf + i, old_size - i);
+		checksum_t csum = ComputeChecksum(oldbuf + i, size);
+		gChunkMap[csum].emplace_back(file_id, i, size);
+		i += size;
+	}
+}
+
+
+// Content-defined chunking mode (--cdc), pass 2.
+// Fills one insert left by the block matcher, from new file offset ins_start to ins_end.
+// Chunks it the same way as the old files and looks up each chunk in the chunk map.
+// A found chunk is extended forward and backward within the insert, just like the block matches,
+// so matches are not limited to chunk boundaries. Content moved between files is found,
+// because the chunk map contains the chunks of all files.
+// The blocks are added to the block list before it_next, the block following the insert.
+// Returns the number of bytes to copy.
+static uint64_t ChunkParseInsert(const CContentChunker &chunker, const std::vector<char *> &oldbufs, const std::vector<uint64_t> &old_sizes,
+	const char *newbuf, TOffset ins_start, TOffset ins_end, TBlockListIter it_next)
+{
+	uint64_t total_size_to_copy = 0;
+	TOffset insert_start = ins_start;	// start of the pending insert, i.e. end of the previous block
+	TOffset k = ins_start;
+	while (k < ins_end)
+	{
+		TOffset chunk_size = (TOffset)chunker.NextChunk(newbuf + k, ins_end - k);
+
+		// chunks overlapped by the previous block can not start a new block
+		auto it = gChunkMap.end();
+		if (k >= insert_start)
+			it = gChunkMap.find(ComputeChecksum(newbuf + k, chunk_size));
+
+		if (it == gChunkMap.end())
+		{
+			k += chunk_size;
+			continue;
+		}
+
+		// verify candidates and take the one with the longest forward extension
+		uint32_t best_file = 0;
+		TOffset best_off = 0;
+		TOffset best_size = 0;
+		size_t n = 0;
+		for (auto it_ref = it->second.begin(); it_ref != it->second.end() && n < MaxCandidates; it_ref++, n++)
+		{
+			if (it_ref->m_nSize != chunk_size)
+				continue;
+
+			const char *oldbuf = oldbufs[it_ref->m_nFileId];
+			if (memcmp(oldbuf + it_ref->m_nOffset, newbuf + k, chunk_size) != 0)
+				continue;
+
+			uint64_t max_len = std::min<uint64_t>(old_sizes[it_ref->m_nFileId] - it_ref->m_nOffset, ins_end - k);
+			TOffset size = chunk_size + (TOffset)MatchLengthForward(oldbuf + it_ref->m_nOffset + chunk_size, newbuf + k + chunk_size, max_len - chunk_size);
+			if (size > best_size)
+			{
+				best_size = size;
+				best_off = it_ref->m_nOffset;
+				best_file = it_ref->m_nFileId;
+			}
+		}
+
+		if (best_size == 0)
+		{
+			k += chunk_size;
+			continue;
+		}
+
+		// extend backward into the pending insert
+		const char *oldbuf = oldbufs[best_file];
+		TOffset back = (TOffset)MatchLengthBackward(oldbuf + best_off, newbuf + k, std::min(k - insert_start, best_off));
+		TOffset start = k - back;
+		best_off -= back;
+		best_size += back;
+
+		gBlockList.emplace(it_next, start, best_size, best_off, best_file);
+		total_size_to_copy += best_size;
+		insert_start = start + best_size;
+
+		// A few changed bytes, e.g. a changed absolute address, often interrupt a match.
+		// So try to continue on the same diagonal before looking at the next chunk.
+		TOffset ii = best_off + best_size;
+		TOffset kk = insert_start;
+		for (TOffset skip = 1; skip <= BlockSize; skip++)
+		{
+			if (ii + skip + BlockSize > old_sizes[best_file] || kk + skip + BlockSize > ins_end)
+				break;
+			if (memcmp(oldbuf + ii + skip, newbuf + kk + skip, BlockSize) != 0)
+				continue;
+
+			TOffset i_start = ii + skip;
+			TOffset k_start = kk + skip;
+			uint64_t max_len = std::min<uint64_t>(old_sizes[best_file] - i_start, ins_end - k_start);
+			TOffset size = BlockSize + (TOffset)MatchLengthForward(oldbuf + i_start + BlockSize, newbuf + k_start + BlockSize, max_len - BlockSize);
+			ii = i_start + size;
+			kk = k_start + size;
+
+			gBlockList.emplace(it_next, k_start, kk - k_start, i_start, best_file);
+			total_size_to_copy += kk - k_start;
+			insert_start = kk;
+			skip = 0;
+		}
+
+		// continue chunking where the chunk ends, to keep chunk boundaries in sync with the old files
+		k += chunk_size;
+	}
+
+	return total_size_to_copy;
+}
+
+
+// Content-defined chunking mode (--cdc), pass 2.
+// Runs after the block matcher and searches the chunks of all old files in the inserts it left.
+// So --cdc finds at least the matches of the block matcher.
+// Returns the number of bytes to copy.
+static uint64_t ChunkParse(const std::vector<char *> &oldbufs, const std::vector<uint64_t> &old_sizes, const char *newbuf, uint64_t new_size)
+{
+	CContentChunker chunker;
+	uint64_t total_size_to_copy = 0;
+	TOffset ins_start = 0;
+	TBlockListIter it = gBlockList.begin();
+	while (true)
+	{
+		TOffset ins_end = it == gBlockList.end() ? (TOffset)new_size : it->m_nNewOffset;
+		if (ins_start < ins_end)
+			total_size_to_copy += ChunkParseInsert(chunker, oldbufs, old_sizes, newbuf, ins_start, ins_end, it);
+
+		if (it == gBlockList.end())
+			break;
+		ins_start = it->m_nNewOffset + it->m_nSize;
+		it++;
+	}
+
+	return total_size_to_copy;
+}
+
+
+int wmain(int argc, const wchar_t **argv)
+{
+	const wchar_t *oldfile;
+	const wchar_t *newfile;
+	const wchar_t *patchfile;
+	int level = ParseLevelGreedy;
+	bool cdc = false;
+	std::vector<const wchar_t *> basefiles;
+
+#ifdef TEST_VPE
+	oldfile = L"F:\\tmp\\test rdiff\\vpee3270.dll";
+	newfile = L"F:\\tmp\\test rdiff\\vpee3271.dll";
+	patchfile = L"F:\\tmp\\test rdiff\\vpe.patch";
+#else
+	int arg = 1;
+	while (arg < argc && wcsncmp(argv[arg], L"--", 2) == 0)
+	{
+		if (wcscmp(argv[arg], L"--level") == 0 && arg + 1 < argc)
+		{
+			wchar_t *end;
+			level = (int)wcstol(argv[arg + 1], &end, 10);
+			if (*end != 0 || level < ParseLevelGreedy || level > ParseLevelOptimal)
+			{
+				printf("level must be 0 (greedy), 1 (lazy) or 2 (optimal)\n");
+				exit(1);
+			}
+			arg += 2;
+		}
+		else if (wcscmp(argv[arg], L"--cdc") == 0)
+		{
+			cdc = true;
+			arg++;
+		}
+		else if (wcscmp(argv[arg], L"--base") == 0 && arg + 1 < argc)
+		{
+			basefiles.push_back(argv[arg + 1]);
+			arg += 2;
+		}
+		else
+			break;
+	}
+
+	if (argc - arg != 3 || (!cdc && !basefiles.empty()))
+	{
+		printf("usage: rdiff [--level 0|1|2] [--cdc [--base <basefile>]...] <oldfile> <newfile> <patchfile>\n"
+			"\n"
+			"--level 0  greedy matching (default)\n"
+			"--level 1  lazy matching, usually smaller patches\n"
+			"--level 2  optimal parse, minimizes the uncompressed patch only,\n"
+			"           after compression usually no smaller than level 1\n"
+			"--cdc      additionally search the inserts left by the above for content-defined\n"
+			"           chunks of the old file and the base files, i.e. content moved\n"
+			"           or reordered between files. Use --base for the other old files.\n");
+		exit(1);
+	}
+	oldfile = argv[arg];
+	newfile = argv[arg + 1];
+	patchfile = argv[arg + 2];
+#endif
+
+	// read all files into memory in background threads,
+	// pass 1 processes the old files while they are being read.
+	// base files follow the old file, so the file id is the index into these vectors
+	std::vector<std::unique_ptr<CFileReader>> readers;
+	readers.emplace_back(new CFileReader(oldfile, BlockSize));
+	for (auto basefile : basefiles)
+		readers.emplace_back(new CFileReader(basefile, 0));
+	CFileReader new_reader(newfile, BlockSize);
+
+	// one thread reads the old and base files in the order pass 1 processes them,
+	// a second one reads the new file at the same time
+	std::vector<CFileReader *> old_files;
+	for (auto &reader : readers)
+		old_files.push_back(reader.get());
+	CReaderThread old_thread(old_files);
+	CReaderThread new_thread(std::vector<CFileReader *>(1, &new_reader));
+
+	std::vector<char *> oldbufs;
+	std::vector<uint64_t> old_sizes;
+	for (auto &reader : readers)
+	{
+		oldbufs.push_back(reader->Buffer());
+		old_sizes.push_back(reader->Size());
+	}
+
+	char *oldbuf = oldbufs[0];
+	uint64_t old_size = old_sizes[0];
+	char *newbuf = new_reader.Buffer();
+	uint64_t new_size = new_reader.Size();
+
+	// On a read error return, so the CReaderThread destructors stop the other reads and join.
+	wprintf(L"pass 1, computing search map\n");
+	TOffset map_offset = 0;
+	uint64_t available = 0;
+	while (available < old_size)
+	{
+		if (!readers[0]->Wait(available))
+			return 1;
+		BuildSearchMap(oldbuf, old_size, available, map_offset);
+	}
+
+	if (cdc)
+	{
+		wprintf(L"pass 1, computing chunk map\n");
+		CContentChunker chunker;
+		for (uint32_t f = 0; f < (uint32_t)readers.size(); f++)
+		{
+			TOffset i = 0;
+			available = 0;
+			while (i < old_sizes[f])
+			{
+				if (!readers[f]->Wait(available))
+					return 1;
+				BuildChunkMap(chunker, f, oldbufs[f], old_sizes[f], available, i);
+			}
+		}
+	}
+
+	// the checksums were computed while reading
+	checksum_t chk_old;
+	if (!readers[0]->Checksum(chk_old))
+		return 1;
+
+	std::vector<checksum_t> chk_bases;
+	for (size_t f = 1; f < readers.size(); f++)
+	{
+		chk_bases.push_back(0);
+		if (!readers[f]->Checksum(chk_bases.back()))
+			return 1;
+	}
+
+	// pass 2 needs the whole new file
+	checksum_t chk_new;
+	if (!new_reader.Checksum(chk_new))
+		return 1;
+	wprintf(L"pass 2, search identical blocks in new file\n");
+	uint64_t total_size_to_copy;
+	if (level == ParseLevelLazy)
+		total_size_to_copy = LazyParse(oldbuf, old_size, newbuf, new_size);
+	else if (level == ParseLevelOptimal)
+		total_size_to_copy = OptimalParse(oldbuf, old_size, newbuf, new_size);
+	else
+		total_size_to_copy = GreedyParse(oldbuf, old_size, newbuf, new_size);
+
+	if (cdc)
+	{
+		wprintf(L"pass 2, search identical chunks in remaining inserts\n");
+		total_size_to_copy += ChunkParse(oldbufs, old_sizes, newbuf, new_size);
+	}
+
 #ifdef VERBOSE
-	i = 0;
+	int i = 0;
 	for (auto &it : gBlockList)
 	{
 		wprintf(L"identical block found.\n"
@@ -289,10 +924,23 @@ int wmain(int argc, const wchar_t **argv)
 		exit(1);
 	}
 
-	CPatchFileHeader header(new_size, sizeof(TOffset), chk_old, chk_new);
+	// the ops are small, a large buffer saves most of the write calls
+	setvbuf(fh, NULL, _IOFBF, 1024 * 1024);
+
+	// version 1 patch files are written whenever possible, so older rpatch versions can apply them
+	uint32_t version = basefiles.empty() ? PATCH_FILE_VERSION_SINGLE : PATCH_FILE_VERSION_BASE_FILES;
+	CPatchFileHeader header(new_size, sizeof(TOffset), chk_old, chk_new, version);
 	fwrite(&header, 1, sizeof(header), fh);
 
-	k = 0;
+	if (version >= PATCH_FILE_VERSION_BASE_FILES)
+	{
+		uint32_t base_count = (uint32_t)basefiles.size();
+		fwrite(&base_count, 1, sizeof(base_count), fh);
+		for (auto &chk_base : chk_bases)
+			fwrite(&chk_base, 1, sizeof(chk_base), fh);
+	}
+
+	TOffset k = 0;
 	char cmd;
 	TBlockListIter it = gBlockList.begin();
 	while (it != gBlockList.end())
@@ -307,6 +955,16 @@ int wmain(int argc, const wchar_t **argv)
 			fwrite(newbuf + k, 1, size, fh);
 			k += size;
 		}
+		else if (it->m_nFileId != 0)
+		{
+			cmd = BlockTypeCopyFile;
+			fwrite(&cmd, 1, sizeof(cmd), fh);
+			fwrite(&it->m_nFileId, 1, sizeof(it->m_nFileId), fh);
+			fwrite(&it->m_nOldOffset, 1, sizeof(it->m_nOldOffset), fh);
+			fwrite(&it->m_nSize, 1, sizeof(it->m_nSize), fh);
+			k += it->m_nSize;
+			it++;
+		}
 		else
 		{
 			cmd = BlockTypeCopy;
@@ -40,7 +40,34 @@ checksum_t ComputeChecksum(const char *buffer, size_t len)
 }
 
 
-char *ReadFile(const wchar_t *file_name, uint64_t &size, uint64_t min_size)
+CChecksumStream::CChecksumStream()
+{
+	m_pState = XXH3_createState();
+	XXH3_64bits_reset((XXH3_state_t *)m_pState);
+}
+
+
+CChecksumStream::~CChecksumStream()
+{
+	XXH3_freeState((XXH3_state_t *)m_pState);
+}
+
+
+void CChecksumStream::Update(const char *buffer, size_t len)
+{
+	XXH3_64bits_update((XXH3_state_t *)m_pState, buffer, len);
+}
+
+
+checksum_t CChecksumStream::Digest() const
+{
+	return XXH3_64bits_digest((const XXH3_state_t *)m_pState);
+}
+
+
+// Opens a file for reading and allocates a buffer for all of it.
+// Exits, if the file can not be opened or is smaller than min_size.
+FILE *OpenInputFile(const wchar_t *file_name, uint64_t &size, uint64_t min_size, char *&buffer)
 {
 	struct _stat32i64 stbuf;
 	if (_wstat32i64(file_name, &stbuf) != 0)
@@ -63,16 +90,25 @@ char *ReadFile(const wchar_t *file_name, uint64_t &size, uint64_t min_size)
 		exit(1);
 	}
 
-	char *buf = (char *)malloc(stbuf.st_size);
-	if (!buf)
+	buffer = (char *)malloc(size ? size : 1);
+	if (!buffer)
 	{
 		wprintf(L"out of memory\n");
 		fclose(fh);
 		exit(1);
 	}
 
-	size_t n = fread(buf, 1, stbuf.st_size, fh);
-	if (n != stbuf.st_size) 
+	return fh;
+}
+
+
+char *ReadFile(const wchar_t *file_name, uint64_t &size, uint64_t min_size)
+{
+	char *buf;
+	FILE *fh = OpenInputFile(file_name, size, min_size, buf);
+
+	size_t n = fread(buf, 1, size, fh);
+	if (n != size)
 	{
 		wprintf(L"fread() error on file %s\n", file_name);
 		fclose(fh);
@@ -15,6 +15,11 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
 #if 1
 	typedef uint32_t TOffset;	// sufficient, if processing files < 4 GB
 #else
@@ -23,6 +28,23 @@
 
 typedef uint64_t checksum_t;
 
+FILE *OpenInputFile(const wchar_t *file_name, uint64_t &size, uint64_t min_size, char *&buffer);
 char *ReadFile(const wchar_t *file_name, uint64_t &size, uint64_t min_size);
 checksum_t ComputeChecksum(const char *buffer, size_t len);
 uint32_t RunProcess(const wchar_t *application_name, const wchar_t *command_line);
+
+
+// Checksum computed piece by piece, e.g. while a file is being read.
+// Gives the same result as ComputeChecksum() over all pieces.
+class CChecksumStream
+{
+protected:
+	void	*m_pState;
+
+public:
+	CChecksumStream();
+	~CChecksumStream();
+
+	void Update(const char *buffer, size_t len);
+	checksum_t Digest() const;
+};
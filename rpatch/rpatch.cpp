@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include <string>
+#include <vector>
 
 #include "..\rdiff\utils.h"
 #include "..\rdiff\PatchFileHeader.h"
@@ -32,20 +33,28 @@ int wmain(int argc, const wchar_t **argv)
 	const wchar_t *oldfile;
 	const wchar_t *newfile;
 	const wchar_t *patchfile;
+	std::vector<const wchar_t *> basefiles;
 
 #ifdef TEST_VPE
 	oldfile = L"F:\\tmp\\test rdiff\\vpee3270.dll";
 	newfile = L"F:\\tmp\\test rdiff\\vpee3271.patch.dll";
 	patchfile = L"F:\\tmp\\test rdiff\\vpe.patch";
 #else
-	if (argc != 4)
+	int arg = 1;
+	while (arg + 1 < argc && wcscmp(argv[arg], L"--base") == 0)
 	{
-		printf("usage: rpatch <oldfile> <newfile> <patchfile>\n");
+		basefiles.push_back(argv[arg + 1]);
+		arg += 2;
+	}
+
+	if (argc - arg != 3)
+	{
+		printf("usage: rpatch [--base <basefile>]... <oldfile> <newfile> <patchfile>\n");
 		exit(1);
 	}
-	oldfile = argv[1];
-	newfile = argv[2];
-	patchfile = argv[3];
+	oldfile = argv[arg];
+	newfile = argv[arg + 1];
+	patchfile = argv[arg + 2];
 #endif
 
 	// use lzma.exe to decompress patchfile
@@ -78,7 +87,7 @@ int wmain(int argc, const wchar_t **argv)
 		exit(1);
 	}
 
-	if (header.m_nVersion != PATCH_FILE_VERSION)
+	if (header.m_nVersion > PATCH_FILE_VERSION)
 	{
 		wprintf(L"patch file has higher version, use newer rpatch version\n");
 		exit(1);
@@ -100,6 +109,37 @@ int wmain(int argc, const wchar_t **argv)
 		exit(1);
 	}
 
+	// base files follow the old file, so the file id is the index into these vectors
+	std::vector<char *> oldbufs(1, oldbuf);
+	std::vector<uint64_t> old_sizes(1, old_size);
+	if (header.m_nVersion >= PATCH_FILE_VERSION_BASE_FILES)
+	{
+		uint32_t base_count;
+		fread(&base_count, 1, sizeof(base_count), fh);
+		if (base_count != basefiles.size())
+		{
+			wprintf(L"patch file requires %u base files\n", base_count);
+			exit(1);
+		}
+
+		for (auto basefile : basefiles)
+		{
+			uint64_t base_size;
+			char *basebuf = ReadFile(basefile, base_size, 0);
+
+			checksum_t chk_base;
+			fread(&chk_base, 1, sizeof(chk_base), fh);
+			if (chk_base != ComputeChecksum(basebuf, base_size))
+			{
+				wprintf(L"checksum mismatch (base file %s)\n", basefile);
+				exit(1);
+			}
+
+			oldbufs.push_back(basebuf);
+			old_sizes.push_back(base_size);
+		}
+	}
+
 	// create new file
 	uint64_t new_size = header.m_nFileSize;
 	char *newbuf = (char *)malloc(new_size);
@@ -107,6 +147,7 @@ int wmain(int argc, const wchar_t **argv)
 	char cmd;
 	TOffset size;
 	TOffset oldoffset;
+	uint32_t file_id;
 	uint64_t k = 0;
 	while (k < new_size)
 	{
@@ -117,6 +158,18 @@ int wmain(int argc, const wchar_t **argv)
 			fread(&size, 1, sizeof(size), fh);
 			fread(newbuf + k, 1, size, fh);
 		}
+		else if (cmd == BlockTypeCopyFile)
+		{
+			fread(&file_id, 1, sizeof(file_id), fh);
+			fread(&oldoffset, 1, sizeof(oldoffset), fh);
+			fread(&size, 1, sizeof(size), fh);
+			if (file_id >= oldbufs.size() || (uint64_t)oldoffset + size > old_sizes[file_id])
+			{
+				wprintf(L"corrupt patch file\n");
+				exit(1);
+			}
+			memcpy(newbuf + k, oldbufs[file_id] + oldoffset, size);
+		}
 		else
 		{
 			fread(&oldoffset, 1, sizeof(oldoffset), fh);